@@ -3,6 +3,21 @@
 #include <list>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include <bit>
+#include <variant>
+#include <optional>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <map>
+#include <typeinfo>
+#include <cstring>
 
 
 namespace pbcpp {
@@ -12,6 +27,8 @@ namespace pbcpp {
   using i32 = int32_t;
   using i64 = int64_t;
   using u8 = uint8_t;
+  using u32 = uint32_t;
+  using u64 = uint64_t;
 
 
   // ---- helper code
@@ -21,6 +38,51 @@ namespace pbcpp {
 
     template <class> struct memptr_ret_type : std::type_identity<void> {};
     template <class C, class T> struct memptr_ret_type<T(C::*)> : std::type_identity<T> {};
+
+    // pointers to the entries of a map, ordered by key
+    auto sorted_entries(auto const& map) {
+      vector<typename std::decay_t<decltype(map)>::value_type const*> ret;
+      ret.reserve(map.size());
+      for (auto const& el : map)  ret.push_back(&el);
+      std::sort(ret.begin(), ret.end(), [](auto a, auto b) { return a->first < b->first; });
+      return ret;
+    }
+
+    // ---- wire primitives shared by the runtime and constant encoders
+    constexpr size_t varint_size(u64 val) {
+      size_t n = 1;
+      for (; val >= 0x80; val >>= 7)  n++;
+      return n;
+    }
+
+    constexpr char* put_varint(char* p, u64 val) {
+      for (; val >= 0x80; val >>= 7)  *p++ = char((val & 0x7f) | 0x80);
+      *p++ = char(val);
+      return p;
+    }
+
+    constexpr u64 zigzag32(i32 val) { return u32((u32(val) << 1) ^ u32(val >> 31)); }
+    constexpr u64 zigzag64(i64 val) { return (u64(val) << 1) ^ u64(val >> 63); }
+    constexpr i32 unzigzag32(u64 n) { return i32(u32(n >> 1) ^ (0u - u32(n & 1))); }
+    constexpr i64 unzigzag64(u64 n) { return i64((n >> 1) ^ (0ull - (n & 1))); }
+
+    template <i32 field, i32 wire_type> consteval auto make_tag() {
+      constexpr u64 tag = (u64(field) << 3) | wire_type;
+      std::array<char, varint_size(tag)> ret{};
+      put_varint(ret.data(), tag);
+      return ret;
+    }
+
+    // calls fn(std::integral_constant<size_t,I>{}) for I == idx through a jump table
+    template <size_t N> void visit_index(size_t idx, auto&& fn) {
+      [&]<size_t... I>(std::index_sequence<I...>) {
+        using fn_t = void(*)(decltype(fn)&);
+        static constexpr fn_t table[] = {
+          [](decltype(fn)& f) { f(std::integral_constant<size_t,I>{}); }...
+        };
+        table[idx](fn);
+      }(std::make_index_sequence<N>{});
+    }
   }
 
 
@@ -32,7 +94,7 @@ namespace pbcpp {
   enum pb_type {
     TYPE_DOUBLE, TYPE_FLOAT, TYPE_INT32, TYPE_INT64, TYPE_UINT32, TYPE_UINT64, TYPE_SINT32,
     TYPE_SINT64, TYPE_FIXED32, TYPE_FIXED64, TYPE_SFIXED32, TYPE_SFIXED64, TYPE_BOOL, TYPE_STRING,
-    TYPE_ENUM, TYPE_MSG
+    TYPE_BYTES, TYPE_ENUM, TYPE_MSG, TYPE_MAP, TYPE_ONEOF
   };
   enum pb_wire_type { WT_VARINT=0, WT_I64=1, WT_LEN=2, WT_I32=5 };
 
@@ -55,18 +117,29 @@ namespace pbcpp {
     throw std::runtime_error(oss.str());
   }
 
+  // the encoded tag of a field, computed at compile time
+  template <i32 field, i32 wire_type> constexpr auto tag_bytes = impl::make_tag<field, wire_type>();
+
   template <pb_type type_, pb_name name_, i32 fnum_, auto memptr_>
   struct field {
     static constexpr i32 num = fnum_;
     static constexpr pb_type type = type_;
-    static constexpr std::integral_constant<pb_type,type_> type_ic;
+    static constexpr std::integral_constant<pb_type,type_> type_ic{};
     static constexpr decltype(memptr_) mptr = memptr_;
     static constexpr string_view name{name_.data, name_.len};
-    static constexpr bool can_pack = (type_ != TYPE_STRING) && (type_ != TYPE_MSG);
+    static constexpr bool can_pack = (type_ != TYPE_STRING) && (type_ != TYPE_BYTES) &&
+      (type_ != TYPE_MSG) && (type_ != TYPE_MAP) && (type_ != TYPE_ONEOF);
     using cpptype = impl::memptr_ret_type<decltype(memptr_)>::type;
     static constexpr bool is_repeated = impl::is_vector<cpptype>::value;
   };
 
+  // map<K,V> fields; entries are encoded as messages with the key in field 1 and the value in 2
+  template <pb_type key_type_, pb_type value_type_, pb_name name_, i32 fnum_, auto memptr_>
+  struct map_field : field<TYPE_MAP, name_, fnum_, memptr_> {
+    using key_field = field<key_type_, "key", 1, nullptr>;
+    using value_field = field<value_type_, "value", 2, nullptr>;
+  };
+
   void pb_each_field_r(auto&&) {}
   void pb_each_field_r(auto&& fn, auto f, auto... fs) {
     if constexpr (sizeof...(fs) != 0)  pb_each_field_r(fn, fs...);
@@ -76,12 +149,336 @@ namespace pbcpp {
   template <class... Fields> struct fields {
     static constexpr size_t size = sizeof...(Fields);
 
-    static void each_field(auto&& fn) { (fn(Fields{}), ...); }
+    static constexpr void each_field(auto&& fn) { (fn(Fields{}), ...); }
     static void each_field_r(auto&& fn) { pb_each_field_r(fn, Fields{}...); }
-    static void each_field_exitable(auto&& fn) { (fn(Fields{}) && ...); }
+    static constexpr void each_field_exitable(auto&& fn) { (fn(Fields{}) && ...); }
+
+    // position of the field with number `fnum`, or `size` if there is no such field
+    template <i32 fnum> static constexpr size_t index_of() {
+      size_t i = 0, ret = size;
+      ((Fields::num == fnum ? (ret = i) : 0, i++), ...);
+      return ret;
+    }
+    template <size_t I> using field_at = std::tuple_element_t<I, std::tuple<Fields...>>;
+  };
+
+  // oneofs are stored as std::variant<std::monostate, Alts::cpptype...>; alternative I of the
+  // variant holds field Alts[I-1] and index 0 means that no field is set
+  template <pb_name name_, auto memptr_, class... Alts>
+  struct oneof_field : field<TYPE_ONEOF, name_, 0, memptr_> {
+    using alts = fields<Alts...>;
+  };
+
+
+  // ---- bytes
+  // Immutable byte string with shared ownership.  The data is either an owned copy or a slice of a
+  // larger buffer (such as the decoder input) that is kept alive by the aliasing shared_ptr.  Copies
+  // share the data.  Slices of at least SHARE_MIN bytes are shared rather than copied by the
+  // decoder, and written by the encoder as their own output chunk.
+  struct bytes {
+    static constexpr size_t SHARE_MIN = 1024;
+
+    std::shared_ptr<char const> buf;
+    size_t len = 0;
+
+    bytes() = default;
+    bytes(char const* p, size_t n) : len(n) {
+      if (n == 0)  return;
+      auto copy = std::make_shared_for_overwrite<char[]>(n);
+      ::memcpy(copy.get(), p, n);
+      buf = std::shared_ptr<char const>(copy, copy.get());
+    }
+    bytes(string_view sv) : bytes(sv.data(), sv.size()) {}
+    bytes(char const* str) : bytes(string_view{str}) {}
+    bytes(std::shared_ptr<char const> const& owner, char const* p, size_t n) : buf(owner, p), len(n) {}
+
+    char const* data() const { return buf.get(); }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    char const* begin() const { return data(); }
+    char const* end() const { return data() + len; }
+    string_view view() const { return {data(), len}; }
+    operator string_view() const { return view(); }
+
+    friend std::strong_ordering operator<=>(bytes const& a, bytes const& b) { return a.view() <=> b.view(); }
+    friend bool operator==(bytes const& a, bytes const& b) { return a.view() == b.view(); }
+    friend std::ostream& operator<<(std::ostream& os, bytes const& b) { return os << b.view(); }
+  };
+
+
+  // ---- cached sub-messages
+  // Wraps a sub-message and keeps the bytes from its last encoding.  All mutation goes through
+  // mut() or assignment, which bump the generation and invalidate the cached bytes.  While the
+  // cache is valid, the encoder splices the stored bytes in instead of re-encoding the subtree.
+  // Large bytes values inside it are kept by reference, so caching doesn't copy them.
+  //
+  // Several threads may encode or copy the same (unchanging) message concurrently: the cache is
+  // filled under a lock and published through an atomic generation, and copies read it under the
+  // same lock.  Mutating it while it is being encoded is a race, as for any other field.  Note that
+  // a T& kept from mut() and written to after the next encode leaves the cache stale; call mut()
+  // or invalidate() again first.
+  template <class T> struct cached {
+    cached() = default;
+    cached(T init) : val(std::move(init)) {}
+
+    cached(cached const& o) : val(o.val), gen(o.gen) { copy_cache(o); }
+    cached(cached&& o) noexcept
+    : val(std::move(o.val)), gen(o.gen), enc_gen(o.enc_gen.load(std::memory_order_relaxed)), enc(std::move(o.enc))
+    {
+      o.enc_gen.store(~u64(0), std::memory_order_relaxed);
+    }
+
+    cached& operator=(cached const& o) {
+      if (this != &o) {
+        val = o.val;
+        gen = o.gen;
+        copy_cache(o);
+      }
+      return *this;
+    }
+    cached& operator=(cached&& o) noexcept {
+      if (this != &o) {
+        val = std::move(o.val);
+        gen = o.gen;
+        enc = std::move(o.enc);
+        enc_gen.store(o.enc_gen.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        o.enc_gen.store(~u64(0), std::memory_order_relaxed);
+      }
+      return *this;
+    }
+
+    T const& get() const { return val; }
+    T const& operator*() const { return val; }
+    T const* operator->() const { return &val; }
+
+    T& mut() {
+      invalidate();
+      return val;
+    }
+
+    cached& operator=(T newval) {
+      val = std::move(newval);
+      invalidate();
+      return *this;
+    }
+
+    void invalidate() { gen++; }
+    u64 generation() const { return gen; }
+    bool is_cached() const { return enc_gen.load(std::memory_order_acquire) == gen; }
+    // the cached encoding, or an empty string if it is stale
+    string encoded() const {
+      string ret;
+      if (is_cached()) {
+        for (auto const& piece : enc)  ret += piece.view();
+      }
+      return ret;
+    }
+
+  private:
+    friend struct encoder;
+
+    // `o` may be encoded (and its cache filled) by another thread meanwhile
+    void copy_cache(cached const& o) {
+      std::lock_guard lock(o.fill_mtx);
+      if (o.is_cached()) {
+        enc = o.enc;
+        enc_gen.store(gen, std::memory_order_release);
+      } else {
+        enc_gen.store(~u64(0), std::memory_order_relaxed);
+        enc.clear();
+      }
+    }
+
+    T val;
+    u64 gen = 0;
+    mutable std::atomic<u64> enc_gen = ~u64(0);  // generation that `enc` was encoded from
+    mutable vector<bytes> enc;  // in output order; shared chunks (large bytes values) stay shared
+    mutable std::mutex fill_mtx;
   };
 
 
+  // ---- metrics
+  // Opt-in codec instrumentation, compiled in only when PBCPP_METRICS is 1 (per-field byte
+  // accounting additionally needs PBCPP_METRICS_FIELDS).  Every thread updates its own counters
+  // for each message type without locking, and snapshot() sums them across all threads.
+  #ifndef PBCPP_METRICS
+  #define PBCPP_METRICS 0
+  #endif
+  #ifndef PBCPP_METRICS_FIELDS
+  #define PBCPP_METRICS_FIELDS 0
+  #endif
+
+  namespace metrics {
+    constexpr bool enabled = PBCPP_METRICS;
+    constexpr bool fields_enabled = enabled && PBCPP_METRICS_FIELDS;
+    constexpr size_t HIST_BUCKETS = 33;  // bucket i counts sizes with bit_width(size) == i
+
+    using clock = std::chrono::steady_clock;
+
+    struct codec_stats {
+      u64 count = 0;
+      u64 bytes = 0;
+      u64 nanos = 0;  // only top-level encodes and decodes are timed
+      std::array<u64, HIST_BUCKETS> hist{};
+    };
+
+    struct field_stats {
+      i32 num;
+      string_view name;
+      u64 encode_bytes = 0;
+      u64 decode_bytes = 0;
+    };
+
+    struct type_stats {
+      string_view name;
+      codec_stats encode;
+      codec_stats decode;
+      u64 chunk_allocs = 0;
+      u64 unknown_skips = 0;
+      vector<field_stats> fields;
+    };
+
+    // only ever written by the owning thread, so a relaxed load and store is enough
+    struct counter {
+      std::atomic<u64> val{0};
+
+      void add(u64 n) { val.store(val.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+      u64 get() const { return val.load(std::memory_order_relaxed); }
+    };
+
+    struct codec_counters {
+      counter count;
+      counter bytes;
+      counter nanos;
+      std::array<counter, HIST_BUCKETS> hist;
+
+      void record(u64 size) {
+        count.add(1);
+        bytes.add(size);
+        hist[std::min<size_t>(std::bit_width(size), HIST_BUCKETS-1)].add(1);
+      }
+
+      void add_to(codec_stats& st) const {
+        st.count += count.get();
+        st.bytes += bytes.get();
+        st.nanos += nanos.get();
+        for (size_t i=0; i<HIST_BUCKETS; i++)  st.hist[i] += hist[i].get();
+      }
+    };
+
+    struct type_counters {
+      type_stats const& desc;
+      codec_counters encode;
+      codec_counters decode;
+      counter chunk_allocs;
+      counter unknown_skips;
+      std::unique_ptr<counter[]> field_encode;
+      std::unique_ptr<counter[]> field_decode;
+
+      type_counters(type_stats const& desc_)
+      : desc(desc_)
+      , field_encode(new counter[desc_.fields.size()])
+      , field_decode(new counter[desc_.fields.size()])
+      {}
+
+      void add_to(type_stats& st) const {
+        encode.add_to(st.encode);
+        decode.add_to(st.decode);
+        st.chunk_allocs += chunk_allocs.get();
+        st.unknown_skips += unknown_skips.get();
+        for (size_t i=0; i<st.fields.size(); i++) {
+          st.fields[i].encode_bytes += field_encode[i].get();
+          st.fields[i].decode_bytes += field_decode[i].get();
+        }
+      }
+    };
+
+    // counters of the live threads, plus the totals of threads that have exited
+    struct registry {
+      std::mutex mtx;
+      std::list<type_counters const*> live;
+      std::map<type_stats const*, type_stats> retired;
+
+      static registry& get() {
+        static registry reg;
+        return reg;
+      }
+    };
+
+    // the proto name emitted by the plugin, falling back to the C++ type name
+    template <class T> string_view msg_name() {
+      if constexpr (requires { reflect<T>::full_name; }) {
+        return reflect<T>::full_name;
+      } else {
+        return typeid(T).name();
+      }
+    }
+
+    // name and field list of a message type, with all counts zero
+    template <class T> type_stats const& desc() {
+      static type_stats const ret = [] {
+        type_stats st;
+        st.name = msg_name<T>();
+        reflect<T>::each_field([&](auto f) { st.fields.push_back({f.num, f.name}); });
+        return st;
+      }();
+      return ret;
+    }
+
+    template <class T> type_counters& local() {
+      struct holder {
+        type_counters c{desc<T>()};
+
+        holder() {
+          auto& reg = registry::get();
+          std::lock_guard lock(reg.mtx);
+          reg.live.push_back(&c);
+        }
+
+        ~holder() {
+          auto& reg = registry::get();
+          std::lock_guard lock(reg.mtx);
+          reg.live.remove(&c);
+          c.add_to(reg.retired.try_emplace(&c.desc, c.desc).first->second);
+        }
+      };
+      thread_local holder h;
+      return h.c;
+    }
+
+    // totals across all threads, one entry per message type that has been encoded or decoded
+    inline vector<type_stats> snapshot() {
+      auto& reg = registry::get();
+      std::lock_guard lock(reg.mtx);
+      auto totals = reg.retired;
+      for (auto c : reg.live) {
+        c->add_to(totals.try_emplace(&c->desc, c->desc).first->second);
+      }
+
+      vector<type_stats> ret;
+      for (auto& [desc, st] : totals)  ret.push_back(std::move(st));
+      return ret;
+    }
+
+    inline u64 nanos_since(clock::time_point start) {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    }
+
+    // buffers allocated by one encoder that haven't been charged to a message type yet
+    struct alloc_counter {
+      u64 pending = 0;
+
+      void add() { pending++; }
+      u64 take() { return std::exchange(pending, 0); }
+    };
+    struct no_alloc_counter {
+      void add() {}
+      u64 take() { return 0; }
+    };
+    using encoder_allocs = std::conditional_t<enabled, alloc_counter, no_alloc_counter>;
+  }
+
+
   // ---- encoder
   struct rd_buf {
     rd_buf(rd_buf const&) = delete;
@@ -90,15 +487,35 @@ namespace pbcpp {
     char* const begin;
     char const* const end;
     char* curs;
+    bool const owned;                 // begin was malloc'd by this chunk
+    std::shared_ptr<char const> ref;  // set for chunks that reference external data
 
     rd_buf(size_t size)
     : begin((char*)::malloc(size))
     , end(begin + size)
     , curs(begin + size)
+    , owned(true)
+    {}
+
+    // an empty chunk over the unused space [begin_, end_) of an earlier one
+    rd_buf(char* begin_, char* end_)
+    : begin(begin_)
+    , end(end_)
+    , curs(end_)
+    , owned(false)
+    {}
+
+    // a full chunk holding `len` bytes of external data
+    rd_buf(std::shared_ptr<char const> ref_, size_t len)
+    : begin((char*)ref_.get())
+    , end(begin + len)
+    , curs(begin)
+    , owned(false)
+    , ref(std::move(ref_))
     {}
 
     ~rd_buf() {
-      ::free(begin);
+      if (owned)  ::free(begin);
     }
   };
 
@@ -108,9 +525,15 @@ namespace pbcpp {
     std::list<rd_buf> bufs;
     size_t size = 0;
     size_t offset = 0;
+    [[no_unique_address]] metrics::encoder_allocs chunk_allocs;
 
     encoder() {
+      add_chunk();
+    }
+
+    void add_chunk() {
       bufs.emplace_back(BUFSZ);
+      chunk_allocs.add();
     }
 
     i64 get_size() const {
@@ -126,138 +549,263 @@ namespace pbcpp {
         auto leftover = sz - remaining;
         bufs.back().curs -= remaining;
         ::memcpy(bufs.back().curs, ((char*)p) + leftover, remaining);
-        offset += BUFSZ;
-        bufs.emplace_back(BUFSZ);
+        offset += bufs.back().end - bufs.back().curs;
+        add_chunk();
         write(p, leftover);
       }
     }
 
+    // adds external data as its own chunk rather than copying it.  Writing carries on in the unused
+    // front of the current chunk, so many shared values don't each cost a new buffer.
+    void write_ref(std::shared_ptr<char const> ref, size_t len) {
+      auto& cur = bufs.back();
+      offset += (cur.end - cur.curs) + len;
+      auto free_begin = cur.begin;
+      auto free_end = cur.curs;
+      bufs.emplace_back(std::move(ref), len);
+      if (free_end != free_begin) {
+        bufs.emplace_back(free_begin, free_end);
+      } else {
+        add_chunk();
+      }
+    }
+
+    // large values are referenced as their own chunk, small ones are copied
+    void write_bytes(bytes const& val) {
+      if (val.size() >= bytes::SHARE_MIN) {
+        write_ref(val.buf, val.size());
+      } else {
+        write(val.data(), val.size());
+      }
+    }
+
     void encode_varint(i64 val) {
       char buf[10];
-      i32 pos = 0;
-      while (val >= 0x80) {
-        buf[pos++] = (val & 0x7f) | 0x80;
-        val >>= 7;
-      }
-      buf[pos++] = (val & 0x7f);
-      write(buf,pos);
+      write(buf, impl::put_varint(buf, val) - buf);
     }
 
-    void encode_tag(i32 field, i32 wire_type) {
-      if (field <= 0)  return;
-      encode_varint((field<<3) + wire_type);
+    template <i32 field, i32 wire_type> void encode_tag() {
+      write(tag_bytes<field, wire_type>.data(), tag_bytes<field, wire_type>.size());
     }
 
-    void encode_varint(i64 val, i32 field, bool can_skip) {
+    // the tag of `fspec`, if `tagged` (packed elements and top-level messages are untagged)
+    template <i32 wire_type> void encode_tag(bool tagged, auto fspec) {
+      if (tagged)  encode_tag<decltype(fspec)::num, wire_type>();
+    }
+
+    // splices in bytes encoded ahead of time, e.g. by encode_constant()
+    template <size_t N> void write(std::array<char,N> const& encoded) {
+      write(encoded.data(), N);
+    }
+
+    void encode_varint(i64 val, bool tagged, auto fspec, bool can_skip) {
       if (can_skip && (val==0))  return;
       encode_varint(val);
-      encode_tag(field, WT_VARINT);
+      encode_tag<WT_VARINT>(tagged, fspec);
     }
 
     void encode_i32(i32 val) {
       write(&val, 4);
     }
 
-    void encode_i32(i32 val, i32 field, bool can_skip) {
+    void encode_i32(i32 val, bool tagged, auto fspec, bool can_skip) {
       if (can_skip && (val==0))  return;
       encode_i32(val);
-      encode_tag(field, WT_I32);
+      encode_tag<WT_I32>(tagged, fspec);
     }
 
     void encode_i64(i64 val) {
       write(&val, 8);
     }
 
-    void encode_i64(i64 val, i32 field, bool can_skip) {
+    void encode_i64(i64 val, bool tagged, auto fspec, bool can_skip) {
       if (can_skip && (val==0))  return;
       encode_i64(val);
-      encode_tag(field, WT_I64);
+      encode_tag<WT_I64>(tagged, fspec);
     }
 
-    void encode_tag_len(i32 field, i32 len) {
+    void encode_tag_len(bool tagged, auto fspec, i32 len) {
       encode_varint(len);
-      encode_tag(field, WT_LEN);
+      encode_tag<WT_LEN>(tagged, fspec);
     }
 
-    void encode_str(string_view sv, i32 field, bool can_skip) {
+    void encode_str(string_view sv, bool tagged, auto fspec, bool can_skip) {
       if (can_skip && sv.empty())  return;
       write(sv.data(), sv.size());
-      encode_tag_len(field, sv.size());
+      encode_tag_len(tagged, fspec, sv.size());
+    }
+
+    void encode_bytes(bytes const& val, bool tagged, auto fspec, bool can_skip) {
+      if (can_skip && val.empty())  return;
+      write_bytes(val);
+      encode_tag_len(tagged, fspec, val.size());
     }
 
-    void encode_zigzag32(i32 val, i32 field, bool can_skip) {
-      val = (val << 1) ^ (val >> 31);
-      encode_varint(val, field, can_skip);
+    void encode_zigzag32(i32 val, bool tagged, auto fspec, bool can_skip) {
+      encode_varint(impl::zigzag32(val), tagged, fspec, can_skip);
     }
 
-    void encode_zigzag64(i64 val, i32 field, bool can_skip) {
-      val = (val << 1) ^ (val >> 31);
-      encode_varint(val, field, can_skip);
+    void encode_zigzag64(i64 val, bool tagged, auto fspec, bool can_skip) {
+      encode_varint(impl::zigzag64(val), tagged, fspec, can_skip);
     }
 
     template <class T>
-    void encode_field(vector<T> const& val, i32 field, auto fspec, bool can_skip) {
+    void encode_field(vector<T> const& val, bool tagged, auto fspec, bool can_skip) {
       if (can_skip && val.empty())  return;
 
+      auto size = get_size();
       for (auto iter=val.rbegin(); iter != val.rend(); iter++) {
         if constexpr (fspec.can_pack) {
-          encode_field(*iter, 0, fspec, false);
+          encode_field(*iter, false, fspec, false);
         } else {
-          encode_field(*iter, field, fspec, false);
+          encode_field(*iter, tagged, fspec, false);
         }
       }
 
       if constexpr (fspec.can_pack) {
-        encode_tag_len(field, val.size());
+        encode_tag_len(tagged, fspec, get_size() - size);
       }
     }
 
-    void encode_field(auto const& val, i32 field, auto fspec, bool can_skip) {
+    template <class T>
+    void encode_field(cached<T> const& val, bool tagged, auto fspec, bool can_skip) {
+      static_assert(fspec.type == TYPE_MSG);
+      size_t size = 0;
+      if (val.is_cached()) {
+        for (auto iter = val.enc.rbegin(); iter != val.enc.rend(); ++iter) {
+          write_bytes(*iter);
+          size += iter->size();
+        }
+      } else {
+        size = get_size();
+        encode_field(val.val, false, fspec, false);
+        size = get_size() - size;
+
+        // publish the bytes, unless another thread is already doing so
+        std::unique_lock lock(val.fill_mtx, std::try_to_lock);
+        if (lock && !val.is_cached()) {
+          val.enc = share_recent(size);
+          val.enc_gen.store(val.gen, std::memory_order_release);
+        }
+      }
+
+      if (tagged && (!can_skip || (size != 0))) {
+        encode_tag_len(tagged, fspec, size);
+      }
+    }
+
+    void encode_field(auto const& val, bool tagged, auto fspec, bool can_skip) {
       constexpr auto ftype = fspec.type;
       if constexpr (
         ftype == TYPE_INT32 || ftype == TYPE_INT64 || ftype == TYPE_UINT32 || ftype == TYPE_UINT64 ||
         ftype == TYPE_BOOL || ftype == TYPE_ENUM
       ) {
-        encode_varint(val, field, can_skip);
+        encode_varint(val, tagged, fspec, can_skip);
       } else if constexpr (ftype == TYPE_SINT32) {
-        encode_zigzag32(val, field, can_skip);
+        encode_zigzag32(val, tagged, fspec, can_skip);
       } else if constexpr (ftype == TYPE_SINT64) {
-        encode_zigzag64(val, field, can_skip);
+        encode_zigzag64(val, tagged, fspec, can_skip);
       } else if constexpr (ftype == TYPE_SFIXED32 || ftype == TYPE_FIXED32 || ftype == TYPE_FLOAT) {
-        encode_i32(*(i32*)&val, field, can_skip);
+        encode_i32(*(i32*)&val, tagged, fspec, can_skip);
       } else if constexpr (ftype == TYPE_SFIXED64 || ftype == TYPE_FIXED64 || ftype == TYPE_DOUBLE) {
-        encode_i64(*(i64*)&val, field, can_skip);
+        encode_i64(*(i64*)&val, tagged, fspec, can_skip);
       } else if constexpr (ftype == TYPE_STRING) {
-        encode_str(val, field, can_skip);
+        encode_str(val, tagged, fspec, can_skip);
+      } else if constexpr (ftype == TYPE_BYTES) {
+        encode_bytes(val, tagged, fspec, can_skip);
+
+      // oneof
+      } else if constexpr (ftype == TYPE_ONEOF) {
+        using alts = typename std::decay_t<decltype(fspec)>::alts;
+        impl::visit_index<alts::size + 1>(val.index(), [&](auto idx) {
+          if constexpr (idx != 0) {
+            using alt = typename alts::template field_at<idx - 1>;
+            encode_field(std::get<idx>(val), true, alt{}, false);
+          }
+        });
+
+      // map
+      } else if constexpr (ftype == TYPE_MAP) {
+        using spec = std::decay_t<decltype(fspec)>;
+        for (auto const& [k, v] : val) {
+          auto size = get_size();
+          encode_field(v, true, typename spec::value_field{}, true);
+          encode_field(k, true, typename spec::key_field{}, true);
+          encode_tag_len(tagged, fspec, get_size() - size);
+        }
 
       // message
       } else {
         static_assert(ftype == TYPE_MSG);
+        using msg_t = std::decay_t<decltype(val)>;
         auto size = get_size();
-        reflect<std::decay_t<decltype(val)>>::each_field_r([&](auto f) {
-          encode_field(val.*f.mptr, f.num, f, true);
+        size_t idx = reflect<msg_t>::size;
+        reflect<msg_t>::each_field_r([&](auto f) {
+          idx--;
+          if constexpr (metrics::fields_enabled) {
+            auto fsize = get_size();
+            encode_field(val.*f.mptr, true, f, true);
+            metrics::local<msg_t>().field_encode[idx].add(get_size() - fsize);
+          } else {
+            encode_field(val.*f.mptr, true, f, true);
+          }
         });
+        size = get_size() - size;
+        if constexpr (metrics::enabled)  metrics::local<msg_t>().encode.record(size);
 
         // write the size and tag
-        if (field > 0) {
-          size = get_size() - size;
+        if (tagged) {
           if (!can_skip || (size != 0)) {
-            encode_tag_len(field, size);
+            encode_tag_len(tagged, fspec, size);
           }
         }
       }
     }
 
     void encode_top(auto const& msg) {
-      encode_field(msg, 0, field<TYPE_MSG,"",0,nullptr>{}, false);
+      if constexpr (metrics::enabled) {
+        auto start = metrics::clock::now();
+        encode_field(msg, false, field<TYPE_MSG,"",0,nullptr>{}, false);
+
+        auto& counters = metrics::local<std::decay_t<decltype(msg)>>();
+        counters.encode.nanos.add(metrics::nanos_since(start));
+        counters.chunk_allocs.add(chunk_allocs.take());
+      } else {
+        encode_field(msg, false, field<TYPE_MSG,"",0,nullptr>{}, false);
+      }
     }
 
-    void copy_into(char* p) {
+    // calls fn(string_view) for each chunk of the output in order, e.g. to build an iovec
+    void each_chunk(auto&& fn) const {
       for (auto iter = bufs.rbegin(); iter != bufs.rend(); ++iter) {
-        auto const bufsz = (iter->end - iter->curs);
-        ::memcpy(p, iter->curs, bufsz);
-        p += bufsz;
+        if (iter->curs != iter->end)  fn(string_view(iter->curs, iter->end - iter->curs));
+      }
+    }
+
+    void copy_into(char* p) {
+      each_chunk([&](string_view chunk) {
+        ::memcpy(p, chunk.data(), chunk.size());
+        p += chunk.size();
+      });
+    }
+
+    // the most recently written `len` bytes, which are the front of the output, as pieces in order.
+    // Chunks that reference external data are kept by reference, the rest is copied.
+    vector<bytes> share_recent(size_t len) const {
+      vector<bytes> ret;
+      string copied;
+      for (auto iter = bufs.rbegin(); len > 0; ++iter) {
+        auto const bufsz = std::min<size_t>(len, iter->end - iter->curs);
+        if (iter->ref) {
+          if (!copied.empty())  ret.emplace_back(std::exchange(copied, {}));
+          ret.emplace_back(iter->ref, iter->curs, bufsz);
+        } else {
+          copied.append(iter->curs, bufsz);
+        }
+        len -= bufsz;
       }
+      if (!copied.empty())  ret.emplace_back(copied);
+      return ret;
     }
 
     string as_str() {
@@ -276,9 +824,130 @@ namespace pbcpp {
   };
 
 
+  // ---- constant encoding
+  // Forward-writing encoder that can run during constant evaluation.  It produces the same bytes
+  // as `encoder`, but for scalar, string, repeated, message and oneof fields only.  With a null
+  // `out` it only measures.
+  struct const_encoder {
+    char* out = nullptr;
+    size_t size = 0;
+
+    constexpr void put(char ch) {
+      if (out)  out[size] = ch;
+      size++;
+    }
+
+    constexpr void put_varint(u64 val) {
+      if (out)  impl::put_varint(out + size, val);
+      size += impl::varint_size(val);
+    }
+
+    constexpr void put_fixed(u64 val, size_t len) {
+      for (size_t i=0; i<len; i++)  put(char(val >> (8*i)));
+    }
+
+    template <i32 wire_type> constexpr void put_tag(bool tagged, auto fspec) {
+      if (!tagged)  return;
+      for (char ch : tag_bytes<decltype(fspec)::num, wire_type>)  put(ch);
+    }
+
+    template <class T>
+    constexpr void encode_field(vector<T> const& val, bool tagged, auto fspec, bool can_skip) {
+      if (can_skip && val.empty())  return;
+
+      if constexpr (fspec.can_pack) {
+        const_encoder sizer;
+        for (auto const& el : val)  sizer.encode_field(el, false, fspec, false);
+        put_tag<WT_LEN>(tagged, fspec);
+        put_varint(sizer.size);
+        for (auto const& el : val)  encode_field(el, false, fspec, false);
+      } else {
+        for (auto const& el : val)  encode_field(el, tagged, fspec, false);
+      }
+    }
+
+    constexpr void encode_field(auto const& val, bool tagged, auto fspec, bool can_skip) {
+      constexpr auto ftype = fspec.type;
+      using val_t = std::decay_t<decltype(val)>;
+      if constexpr (
+        ftype == TYPE_INT32 || ftype == TYPE_INT64 || ftype == TYPE_UINT32 || ftype == TYPE_UINT64 ||
+        ftype == TYPE_BOOL || ftype == TYPE_ENUM
+      ) {
+        if (can_skip && (i64(val) == 0))  return;
+        put_tag<WT_VARINT>(tagged, fspec);
+        put_varint(i64(val));
+      } else if constexpr (ftype == TYPE_SINT32 || ftype == TYPE_SINT64) {
+        u64 n = 0;
+        if constexpr (ftype == TYPE_SINT32) {
+          n = impl::zigzag32(val);
+        } else {
+          n = impl::zigzag64(val);
+        }
+        if (can_skip && (n == 0))  return;
+        put_tag<WT_VARINT>(tagged, fspec);
+        put_varint(n);
+      } else if constexpr (ftype == TYPE_SFIXED32 || ftype == TYPE_FIXED32 || ftype == TYPE_FLOAT) {
+        u32 bits = std::is_floating_point_v<val_t> ? std::bit_cast<u32>(float(val)) : u32(val);
+        if (can_skip && (bits == 0))  return;
+        put_tag<WT_I32>(tagged, fspec);
+        put_fixed(bits, 4);
+      } else if constexpr (ftype == TYPE_SFIXED64 || ftype == TYPE_FIXED64 || ftype == TYPE_DOUBLE) {
+        u64 bits = std::is_floating_point_v<val_t> ? std::bit_cast<u64>(double(val)) : u64(val);
+        if (can_skip && (bits == 0))  return;
+        put_tag<WT_I64>(tagged, fspec);
+        put_fixed(bits, 8);
+      } else if constexpr (ftype == TYPE_STRING) {
+        if (can_skip && val.empty())  return;
+        put_tag<WT_LEN>(tagged, fspec);
+        put_varint(val.size());
+        for (char ch : val)  put(ch);
+      } else if constexpr (ftype == TYPE_ONEOF) {
+        using alts = typename std::decay_t<decltype(fspec)>::alts;
+        [&]<size_t... I>(std::index_sequence<I...>) {
+          ((val.index() == I+1 ? encode_field(std::get<I+1>(val),
+            true, typename alts::template field_at<I>{}, false) : void()), ...);
+        }(std::make_index_sequence<alts::size>{});
+      } else {
+        static_assert(ftype == TYPE_MSG, "field type is not supported by const_encoder");
+        if (tagged) {
+          const_encoder sizer;
+          sizer.encode_msg(val);
+          if (can_skip && (sizer.size == 0))  return;
+          put_tag<WT_LEN>(tagged, fspec);
+          put_varint(sizer.size);
+        }
+        encode_msg(val);
+      }
+    }
+
+    constexpr void encode_msg(auto const& msg) {
+      reflect<std::decay_t<decltype(msg)>>::each_field([&](auto f) {
+        encode_field(msg.*f.mptr, true, f, true);
+      });
+    }
+  };
+
+  // size of the encoded message, also usable in constant expressions
+  constexpr size_t byte_size(is_message auto const& msg) {
+    const_encoder sizer;
+    sizer.encode_msg(msg);
+    return sizer.size;
+  }
+
+  // encodes the message returned by `make` at compile time, e.g.
+  //   static constexpr auto heartbeat = encode_constant<[] { Ping p; p.kind = 1; return p; }>();
+  template <auto make> consteval auto encode_constant() {
+    std::array<char, byte_size(make())> ret{};
+    const_encoder enc{ret.data()};
+    enc.encode_msg(make());
+    return ret;
+  }
+
+
   struct decoder {
     char const* curs;
     char const* const end;
+    std::shared_ptr<char const> const* owner = nullptr;  // set when the input is a shared buffer
 
     decoder(char const* curs_, char const* end_) : curs(curs_), end(end_) {}
     decoder(string_view sv) : decoder(sv.data(), sv.data() + sv.size()) {}
@@ -286,19 +955,68 @@ namespace pbcpp {
     bool empty() const { return curs >= end; }
 
     void decode_msg(auto& msg) {
+      using msg_t = std::decay_t<decltype(msg)>;
+      if constexpr (metrics::enabled)  metrics::local<msg_t>().decode.record(end - curs);
+
       while (!empty()) {
+        auto start = curs;
         auto tag = read_varint();
         auto field = (tag>>3);
         auto wire_type = (tag&7);
 
-        reflect<std::decay_t<decltype(msg)>>::each_field([&](auto f) {
-          if (f.num == field) {
+        bool found = false;
+        size_t idx = 0, found_idx = 0;
+        reflect<msg_t>::each_field([&](auto f) {
+          if constexpr (f.type == TYPE_ONEOF) {
+            if (decode_oneof((msg.*f.mptr), field, wire_type, f)) {
+              found = true;
+              found_idx = idx;
+            }
+          } else if (f.num == field) {
             decode_field((msg.*f.mptr), wire_type, f);
+            found = true;
+            found_idx = idx;
           }
+          idx++;
         });
+
+        if (!found) {
+          skip_field(wire_type);
+          if constexpr (metrics::enabled)  metrics::local<msg_t>().unknown_skips.add(1);
+        } else if constexpr (metrics::fields_enabled) {
+          metrics::local<msg_t>().field_decode[found_idx].add(curs - start);
+        }
+      }
+    }
+
+    void decode_top(auto& msg) {
+      if constexpr (metrics::enabled) {
+        auto start = metrics::clock::now();
+        decode_msg(msg);
+        metrics::local<std::decay_t<decltype(msg)>>().decode.nanos.add(metrics::nanos_since(start));
+      } else {
+        decode_msg(msg);
       }
     }
 
+    template <class T>
+    void decode_msg(cached<T>& msg) {
+      decode_msg(msg.mut());
+    }
+
+    bool decode_oneof(auto& outv, i64 field, i32 wire_type, auto fspec) {
+      using alts = typename decltype(fspec)::alts;
+      bool found = false;
+      alts::each_field([&](auto alt) {
+        if (alt.num != field)  return;
+        constexpr auto idx = alts::template index_of<decltype(alt)::num>() + 1;
+        if (outv.index() != idx)  outv.template emplace<idx>();
+        decode_field(std::get<idx>(outv), wire_type, alt);
+        found = true;
+      });
+      return found;
+    }
+
     void assert_wire_type(i32 actual, i32 expected) {
       if (actual == -1)  return;
       if (actual != expected)  pb_throw("invalid wire_type");
@@ -314,11 +1032,10 @@ namespace pbcpp {
 
       // handle packed
       } else if constexpr (fspec.can_pack) {
-        auto len = read_varint();
-        auto prevsz = outv.size();
-        outv.resize(len + prevsz);
-        for (size_t i=0; i<len; i++) {
-          decode_field(outv[i+prevsz], -1, fspec);
+        auto decoder = read_buf(read_varint());
+        while (!decoder.empty()) {
+          outv.emplace_back();
+          decoder.decode_field(outv.back(), -1, fspec);
         }
       }
     }
@@ -334,8 +1051,11 @@ namespace pbcpp {
 
       } else if constexpr (ftype == TYPE_SINT32 || ftype == TYPE_SINT64) {
         assert_wire_type(wire_type, WT_VARINT);
-        auto n = read_varint();
-        outv = (n>>1) ^ (-(n&1));
+        if constexpr (ftype == TYPE_SINT32) {
+          outv = impl::unzigzag32(read_varint());
+        } else {
+          outv = impl::unzigzag64(read_varint());
+        }
 
       } else if constexpr (ftype == TYPE_SFIXED32 || ftype == TYPE_FIXED32 || ftype == TYPE_FLOAT) {
         assert_wire_type(wire_type, WT_I32);
@@ -350,6 +1070,33 @@ namespace pbcpp {
         auto decoder = read_buf(read_varint());
         outv.assign(decoder.curs, decoder.end);
 
+      } else if constexpr (ftype == TYPE_BYTES) {
+        assert_wire_type(wire_type, WT_LEN);
+        auto decoder = read_buf(read_varint());
+        auto len = size_t(decoder.end - decoder.curs);
+        if (owner && (len >= bytes::SHARE_MIN)) {
+          outv = bytes(*owner, decoder.curs, len);
+        } else {
+          outv = bytes(decoder.curs, len);
+        }
+
+      } else if constexpr (ftype == TYPE_MAP) {
+        assert_wire_type(wire_type, WT_LEN);
+        auto decoder = read_buf(read_varint());
+        using spec = std::decay_t<decltype(fspec)>;
+        using map_t = std::decay_t<decltype(outv)>;
+        typename map_t::key_type key{};
+        typename map_t::mapped_type value{};
+        while (!decoder.empty()) {
+          auto tag = decoder.read_varint();
+          switch (tag>>3) {
+            case 1:   decoder.decode_field(key, tag&7, typename spec::key_field{}); break;
+            case 2:   decoder.decode_field(value, tag&7, typename spec::value_field{}); break;
+            default:  decoder.skip_field(tag&7); break;
+          }
+        }
+        outv.insert_or_assign(std::move(key), std::move(value));
+
       } else {
         static_assert(ftype == TYPE_MSG);
         assert_wire_type(wire_type, WT_LEN);
@@ -370,10 +1117,21 @@ namespace pbcpp {
       return ret;
     }
 
-    decoder read_buf(i32 len) {
+    void skip_field(i32 wire_type) {
+      switch (wire_type) {
+        case WT_VARINT:  read_varint(); break;
+        case WT_I64:     read_buf(8); break;
+        case WT_LEN:     read_buf(read_varint()); break;
+        case WT_I32:     read_buf(4); break;
+        default:         pb_throw("invalid wire_type");
+      }
+    }
+
+    decoder read_buf(u64 len) {
+      if (len > size_t(end - curs))  pb_throw("length exceeds buffer");
       auto ret = decoder(curs, curs+len);
+      ret.owner = owner;
       curs += len;
-      pb_assert(curs <= end);
       return ret;
     }
 
@@ -386,7 +1144,125 @@ namespace pbcpp {
     // ---- static methods
     static void from_string(string_view sv, auto& msg) {
       decoder decoder(sv);
-      decoder.decode_msg(msg);
+      decoder.decode_top(msg);
+    }
+
+    // large bytes fields reference `buf` instead of copying out of it
+    static void from_shared(std::shared_ptr<char const> const& buf, size_t len, auto& msg) {
+      decoder decoder(buf.get(), buf.get() + len);
+      decoder.owner = &buf;
+      decoder.decode_top(msg);
+    }
+    static void from_shared(std::shared_ptr<string const> const& buf, auto& msg) {
+      from_shared(std::shared_ptr<char const>(buf, buf->data()), buf->size(), msg);
+    }
+    static void from_shared(bytes const& buf, auto& msg) {
+      from_shared(buf.buf, buf.size(), msg);
+    }
+  };
+
+
+  // ---- indexed_view
+  // Scans an encoded message once and records where each top-level field lives, so that single
+  // fields can be decoded on demand and fixed-width fields can be patched without re-encoding.
+  // Only fields listed directly in reflect<T> are addressable; oneof alternatives are not.
+  template <is_message T> struct indexed_view {
+    using refl = reflect<T>;
+    template <i32 fnum> static constexpr size_t field_index() {
+      constexpr auto idx = refl::template index_of<fnum>();
+      static_assert(idx < refl::size, "no such field (oneof alternatives are not addressable)");
+      return idx;
+    }
+    template <i32 fnum> using field_t = typename refl::template field_at<field_index<fnum>()>;
+
+    struct entry {
+      i32 num;
+      i32 wire_type;
+      u32 begin;  // start of the tag
+      u32 value;  // start of the value, after the tag
+      u32 end;
+    };
+
+    char const* const begin;
+    char const* const end;
+    bool const writable;
+    vector<entry> entries;
+    std::array<i32, refl::size> last;  // index into entries of the last occurrence, or -1
+
+    indexed_view(string_view sv) : indexed_view(sv.data(), sv.size(), false) {}
+    indexed_view(char* p, size_t len) : indexed_view(p, len, true) {}
+    indexed_view(string& s) : indexed_view(s.data(), s.size(), true) {}
+
+    template <i32 fnum> bool has() const {
+      return last[field_index<fnum>()] >= 0;
+    }
+
+    // decodes a single field; repeated and message fields merge every occurrence
+    template <i32 fnum> auto get() const {
+      using F = field_t<fnum>;
+      typename F::cpptype ret{};
+      if constexpr (F::is_repeated || F::type == TYPE_MSG || F::type == TYPE_MAP) {
+        for (auto const& e : entries) {
+          if (e.num == fnum)  decode_entry(ret, e, F{});
+        }
+      } else if (auto idx = last[field_index<fnum>()]; idx >= 0) {
+        decode_entry(ret, entries[idx], F{});
+      }
+      return ret;
+    }
+
+    // overwrites a fixed-width field in place; the field must be present in the buffer
+    template <i32 fnum> void patch(typename field_t<fnum>::cpptype val) {
+      using F = field_t<fnum>;
+      constexpr auto ftype = F::type;
+      constexpr bool is_i32 = (ftype == TYPE_SFIXED32 || ftype == TYPE_FIXED32 || ftype == TYPE_FLOAT);
+      constexpr bool is_i64 = (ftype == TYPE_SFIXED64 || ftype == TYPE_FIXED64 || ftype == TYPE_DOUBLE);
+      static_assert((is_i32 || is_i64) && !F::is_repeated, "only fixed-width fields can be patched");
+
+      pb_assert(writable);
+      auto idx = last[field_index<fnum>()];
+      if (idx < 0)  pb_throw("cannot patch missing field: ", F::name);
+      auto const& e = entries[idx];
+      pb_assert(e.wire_type == (is_i32 ? WT_I32 : WT_I64));
+      ::memcpy((char*)begin + e.value, &val, is_i32 ? 4 : 8);
+    }
+
+    T decode() const {
+      T ret;
+      decoder::from_string(data(), ret);
+      return ret;
+    }
+
+    string_view data() const { return {begin, size_t(end - begin)}; }
+
+  private:
+    indexed_view(char const* p, size_t len, bool writable_)
+    : begin(p), end(p + len), writable(writable_)
+    {
+      pb_assert(len <= UINT32_MAX);
+      last.fill(-1);
+
+      decoder dec(begin, end);
+      while (!dec.empty()) {
+        auto start = dec.curs;
+        auto tag = dec.read_varint();
+        auto value = dec.curs;
+        dec.skip_field(tag&7);
+
+        i32 num = (tag>>3);
+        entries.push_back({num, i32(tag&7), u32(start-begin), u32(value-begin), u32(dec.curs-begin)});
+
+        size_t i = 0;
+        refl::each_field([&](auto f) {
+          if (f.num == num)  last[i] = i32(entries.size() - 1);
+          i++;
+        });
+      }
+    }
+
+    void decode_entry(auto& outv, entry const& e, auto fspec) const {
+      decoder dec(begin + e.value, begin + e.end);
+      dec.decode_field(outv, e.wire_type, fspec);
     }
   };
 
@@ -413,6 +1289,23 @@ namespace pbcpp {
           os << el;
         }
         os << ']';
+      } else if constexpr (f.type == TYPE_MAP) {
+        os << '{';
+        int n = 0;
+        for (auto&& [k, v] : val) {
+          if (n++)  os << ',';
+          os << k << ':' << v;
+        }
+        os << '}';
+      } else if constexpr (f.type == TYPE_ONEOF) {
+        using alts = typename decltype(f)::alts;
+        os << '{';
+        impl::visit_index<alts::size + 1>(val.index(), [&](auto idx) {
+          if constexpr (idx != 0) {
+            os << alts::template field_at<idx - 1>::name << ':' << std::get<idx>(val);
+          }
+        });
+        os << '}';
       } else {
         os << val;
       }
@@ -427,6 +1320,14 @@ namespace pbcpp {
   }
 
   template <is_message T> std::strong_ordering compare(T const& a, T const& b) {
+    auto cmp = [](auto const& x, auto const& y) -> std::strong_ordering {
+      if constexpr (is_message<decltype(x)>) {
+        return compare(x, y);
+      } else {
+        return x <=> y;
+      }
+    };
+
     std::strong_ordering ret = std::strong_ordering::equal;
     get_reflect(a).each_field_exitable([&](auto f) {
       auto const& aval = (a.*f.mptr);
@@ -436,6 +1337,23 @@ namespace pbcpp {
         for (int i=0; i<aval.size() && (ret==0); i++) {
           ret = aval[i] <=> bval[i];
         }
+      } else if constexpr (f.type == TYPE_MAP) {
+        ret = aval.size() <=> bval.size();
+        if (ret == 0) {
+          auto aels = impl::sorted_entries(aval);
+          auto bels = impl::sorted_entries(bval);
+          for (size_t i=0; i<aels.size() && (ret==0); i++) {
+            ret = aels[i]->first <=> bels[i]->first;
+            if (ret == 0)  ret = cmp(aels[i]->second, bels[i]->second);
+          }
+        }
+      } else if constexpr (f.type == TYPE_ONEOF) {
+        ret = aval.index() <=> bval.index();
+        if (ret == 0) {
+          impl::visit_index<decltype(f)::alts::size + 1>(aval.index(), [&](auto idx) {
+            if constexpr (idx != 0)  ret = cmp(std::get<idx>(aval), std::get<idx>(bval));
+          });
+        }
       } else {
         ret = aval <=> bval;
       }
@@ -462,12 +1380,247 @@ namespace pbcpp {
         for (auto&& el : val) {
           seed = std_hash_combine(seed, el);
         }
+      } else if constexpr (f.type == TYPE_MAP) {
+        size_t sum = 0;  // independent of iteration order
+        for (auto&& [k, v] : val) {
+          sum += std_hash_combine(std_hash_combine(0, k), v);
+        }
+        seed = std_hash_combine(seed, sum);
+      } else if constexpr (f.type == TYPE_ONEOF) {
+        seed = std_hash_combine(seed, val.index());
+        impl::visit_index<decltype(f)::alts::size + 1>(val.index(), [&](auto idx) {
+          if constexpr (idx != 0)  seed = std_hash_combine(seed, std::get<idx>(val));
+        });
       } else {
         seed = std_hash_combine(seed, val);
       }
     });
     return seed;
   }
+
+  // ---- flat_map
+  // Open-addressing hash map with linear probing, used for map<K,V> fields.  Entries live inline in
+  // a power-of-two table and are removed with backward shifting, so there are no tombstones.
+  struct pb_hash {
+    size_t operator()(auto const& v) const { return std_hash_combine(0, v); }
+  };
+
+  template <class K, class V, class Hash = pb_hash> struct flat_map {
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<K const, V>;
+
+    template <bool is_const> struct iter {
+      using map_t = std::conditional_t<is_const, flat_map const, flat_map>;
+      using value_type = std::conditional_t<is_const, flat_map::value_type const, flat_map::value_type>;
+      using difference_type = std::ptrdiff_t;
+
+      map_t* map = nullptr;
+      size_t idx = 0;
+
+      iter() = default;
+      iter(map_t* map_, size_t idx_) : map(map_), idx(idx_) { skip(); }
+      operator iter<true>() const { return {map, idx}; }
+
+      value_type& operator*() const { return map->slots[idx].value; }
+      value_type* operator->() const { return &map->slots[idx].value; }
+      iter& operator++() { idx++; skip(); return *this; }
+      iter operator++(int) { auto ret = *this; ++*this; return ret; }
+      bool operator==(iter const& o) const { return idx == o.idx; }
+
+      void skip() {
+        while (idx < map->used.size() && !map->used[idx])  idx++;
+      }
+    };
+    using iterator = iter<false>;
+    using const_iterator = iter<true>;
+
+    flat_map() = default;
+    flat_map(flat_map const& o) : slots(o.used.empty() ? nullptr : new slot[o.used.size()]), used(o.used), len(o.len) {
+      for (size_t i=0; i<used.size(); i++) {
+        if (used[i])  new (&slots[i].value) value_type(o.slots[i].value);
+      }
+    }
+    flat_map(flat_map&& o) noexcept : slots(std::move(o.slots)), used(std::move(o.used)), len(o.len) {
+      o.used.clear();
+      o.len = 0;
+    }
+    flat_map& operator=(flat_map o) noexcept {
+      slots.swap(o.slots);
+      used.swap(o.used);
+      std::swap(len, o.len);
+      return *this;
+    }
+    ~flat_map() { destroy_all(); }
+
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+
+    iterator begin() { return {this, 0}; }
+    iterator end() { return {this, used.size()}; }
+    const_iterator begin() const { return {this, 0}; }
+    const_iterator end() const { return {this, used.size()}; }
+
+    void clear() {
+      destroy_all();
+      slots.reset();
+      used.clear();
+      len = 0;
+    }
+
+    void reserve(size_t n) {
+      size_t cap = 8;
+      while (cap * 7 / 8 < n)  cap *= 2;
+      if (cap > used.size())  rehash(cap);
+    }
+
+    iterator find(K const& key) { return {this, lookup(key)}; }
+    const_iterator find(K const& key) const { return {this, lookup(key)}; }
+    bool contains(K const& key) const { return lookup(key) != used.size(); }
+    size_t count(K const& key) const { return contains(key) ? 1 : 0; }
+
+    V& at(K const& key) {
+      auto idx = lookup(key);
+      if (idx == used.size())  pb_throw("key not found in map");
+      return slots[idx].value.second;
+    }
+    V const& at(K const& key) const { return const_cast<flat_map*>(this)->at(key); }
+
+    V& operator[](K const& key) { return slots[emplace_key(key)].value.second; }
+    V& operator[](K&& key) { return slots[emplace_key(std::move(key))].value.second; }
+
+    std::pair<iterator,bool> insert_or_assign(K key, V value) {
+      if (auto idx = lookup(key); idx != used.size()) {
+        slots[idx].value.second = std::move(value);
+        return {{this, idx}, false};
+      }
+      return {{this, insert_new(std::move(key), std::move(value))}, true};
+    }
+
+    size_t erase(K const& key) {
+      auto idx = lookup(key);
+      if (idx == used.size())  return 0;
+
+      // shift back any entries that were displaced past the removed slot
+      auto const mask = used.size() - 1;
+      destroy(idx);
+      for (auto next = (idx + 1) & mask; used[next]; next = (next + 1) & mask) {
+        auto home = bucket(slots[next].value.first);
+        if (((next - home) & mask) >= ((next - idx) & mask)) {
+          move_slot(idx, next);
+          idx = next;
+        }
+      }
+      len--;
+      return 1;
+    }
+
+  private:
+    // Entries are exposed with a const key, but moved through the mutable view when shifting and
+    // rehashing, so keys are never copied.  Both members have the same layout (as in absl's
+    // map_slot_type); `used` says which slots hold a live entry.
+    union slot {
+      value_type value;
+      std::pair<K,V> mut;
+
+      slot() {}
+      ~slot() {}
+    };
+
+    std::unique_ptr<slot[]> slots;
+    vector<u8> used;
+    size_t len = 0;
+
+    size_t bucket(K const& key) const {
+      auto bits = std::countr_zero(used.size());
+      return (u64(Hash{}(key)) * 0x9e3779b97f4a7c15ull) >> (64 - bits);
+    }
+
+    // first free slot at or after the home bucket of `key`
+    size_t free_slot(K const& key) const {
+      auto const mask = used.size() - 1;
+      auto idx = bucket(key);
+      while (used[idx])  idx = (idx + 1) & mask;
+      return idx;
+    }
+
+    // index of the slot holding `key`, or used.size() if not present
+    size_t lookup(K const& key) const {
+      if (len == 0)  return used.size();
+      auto const mask = used.size() - 1;
+      for (auto idx = bucket(key); used[idx]; idx = (idx + 1) & mask) {
+        if (slots[idx].value.first == key)  return idx;
+      }
+      return used.size();
+    }
+
+    // index of the slot holding `key`, inserting a default value if not present
+    template <class KK> size_t emplace_key(KK&& key) {
+      if (auto idx = lookup(key); idx != used.size())  return idx;
+      return insert_new(std::forward<KK>(key));
+    }
+
+    // inserts a key that is known not to be present, constructing the value from `vargs`
+    template <class KK, class... VArgs> size_t insert_new(KK&& key, VArgs&&... vargs) {
+      if ((len + 1) > used.size() * 7 / 8)  rehash(used.empty() ? 8 : used.size() * 2);
+      auto idx = free_slot(key);
+      new (&slots[idx].value) value_type(std::piecewise_construct,
+        std::forward_as_tuple(std::forward<KK>(key)), std::forward_as_tuple(std::forward<VArgs>(vargs)...));
+      used[idx] = 1;
+      len++;
+      return idx;
+    }
+
+    void move_slot(size_t to, size_t from) {
+      new (&slots[to].value) value_type(std::move(slots[from].mut));
+      used[to] = 1;
+      destroy(from);
+    }
+
+    void destroy(size_t idx) {
+      slots[idx].value.~value_type();
+      used[idx] = 0;
+    }
+
+    void destroy_all() {
+      for (size_t i=0; i<used.size(); i++) {
+        if (used[i])  slots[i].value.~value_type();
+      }
+    }
+
+    // moves every entry straight into its new slot; all keys are known to be distinct
+    void rehash(size_t cap) {
+      auto old_slots = std::move(slots);
+      auto old_used = std::move(used);
+      slots.reset(new slot[cap]);
+      used.assign(cap, 0);
+      for (size_t i=0; i<old_used.size(); i++) {
+        if (!old_used[i])  continue;
+        auto& old = old_slots[i];
+        auto idx = free_slot(old.value.first);
+        new (&slots[idx].value) value_type(std::move(old.mut));
+        used[idx] = 1;
+        old.value.~value_type();
+      }
+    }
+  };
+
+  // the container generated for map<K,V> fields; define PBCPP_MAP_TYPE to substitute another one
+  #ifndef PBCPP_MAP_TYPE
+  #define PBCPP_MAP_TYPE ::pbcpp::flat_map
+  #endif
+  template <class K, class V> using map = PBCPP_MAP_TYPE<K,V>;
+
+
+  template <class T> std::ostream& operator<<(std::ostream& os, cached<T> const& msg) {
+    return to_ostream(os, *msg);
+  }
+  template <class T> std::strong_ordering operator<=>(cached<T> const& a, cached<T> const& b) {
+    return compare(*a, *b);
+  }
+  template <class T> bool operator==(cached<T> const& a, cached<T> const& b) {
+    return compare(*a, *b) == 0;
+  }
 }
 
 
@@ -485,6 +1638,18 @@ namespace std {
     }
   };
 
+  template <> struct hash<pbcpp::bytes> {
+    size_t operator()(pbcpp::bytes const& b) const {
+      return hash<string_view>{}(b.view());
+    }
+  };
+
+  template <class T> struct hash<pbcpp::cached<T>> {
+    size_t operator()(pbcpp::cached<T> const& msg) const {
+      return pbcpp::std_hash(*msg);
+    }
+  };
+
   template <pbcpp::is_message T> struct equal_to<T> {
     bool operator()(T const& a, T const& b) const {
       return pbcpp::compare(a,b) == 0;
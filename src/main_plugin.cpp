@@ -84,6 +84,16 @@ struct FileGenerator {
     return std::nullopt;
   }
 
+  bool ext_cached(FieldDescriptor const* field) {
+    auto& unknown = field->options().unknown_fields();
+    for (int i=0, e=unknown.field_count(); i<e; i++) {
+      if (unknown.field(i).number() == 78002) {
+        return unknown.field(i).varint() != 0;
+      }
+    }
+    return false;
+  }
+
   void generateStruct(Descriptor const* msg) {
     printer->Print("struct $name$ {\n", "name", msg->name());
     printer->Indent();
@@ -92,34 +102,35 @@ struct FileGenerator {
       auto field = msg->field(i);
 
       // check for various things that still need to be supported
-      if (field->containing_oneof())  error_unsupported("oneof");
+      if (field->containing_oneof() && !field->real_containing_oneof())  error_unsupported("optional");
+
+      // oneofs become a single variant member, emitted at the position of their first field
+      if (auto oneof = field->real_containing_oneof()) {
+        if (oneof->field(0) != field)  continue;
+        string cpptype = "std::variant<std::monostate";
+        for (int j=0; j<oneof->field_count(); j++) {
+          string unused;
+          cpptype += ", " + cppType(oneof->field(j), unused);
+        }
+        printer->Print("$cpptype$> $name$;\n", "cpptype", cpptype, "name", oneof->name());
+        continue;
+      }
 
       // get the type
-      string cpptype;
       string dflt = " = 0";
-      switch (field->type()) {
-        case FieldDescriptor::TYPE_DOUBLE:   cpptype = "double"; break;
-        case FieldDescriptor::TYPE_FLOAT:    cpptype = "float"; break;
-        case FieldDescriptor::TYPE_INT64:    cpptype = "int64_t"; break;
-        case FieldDescriptor::TYPE_UINT64:   cpptype = "uint64_t"; break;
-        case FieldDescriptor::TYPE_INT32:    cpptype = "int32_t"; break;
-        case FieldDescriptor::TYPE_FIXED64:  cpptype = "int64_t"; break;
-        case FieldDescriptor::TYPE_FIXED32:  cpptype = "int32_t"; break;
-        case FieldDescriptor::TYPE_BOOL:     cpptype = "bool"; dflt = " = false"; break;
-        case FieldDescriptor::TYPE_STRING:   cpptype = "std::string"; dflt = ""; break;
-        case FieldDescriptor::TYPE_GROUP:    error_will_not_support("TYPE_GROUP"); break;
-        case FieldDescriptor::TYPE_MESSAGE:  cpptype = field->type_name(); dflt = ""; break;
-        case FieldDescriptor::TYPE_BYTES:    cpptype = "cbpp::bytes"; dflt = ""; break;
-        case FieldDescriptor::TYPE_UINT32:   cpptype = "uint32_t"; break;
-        case FieldDescriptor::TYPE_ENUM:     cpptype = field->type_name(); break;
-        case FieldDescriptor::TYPE_SFIXED32: cpptype = "int32_t"; break;
-        case FieldDescriptor::TYPE_SFIXED64: cpptype = "int64_t"; break;
-        case FieldDescriptor::TYPE_SINT32:   cpptype = "int32_t"; break;
-        case FieldDescriptor::TYPE_SINT64:   cpptype = "int64_t"; break;
-      }
+      string cpptype = cppType(field, dflt);
 
       // modifiers
-      if (field->has_optional_keyword()) {
+      if (field->type() == FieldDescriptor::TYPE_MESSAGE && !field->is_map() && ext_cached(field)) {
+        cpptype = "::pbcpp::cached<" + cpptype + ">";
+      }
+      if (field->is_map()) {
+        auto entry = field->message_type();
+        string unused;
+        cpptype = "::pbcpp::map<" + cppType(entry->map_key(), unused) + ", " +
+                  cppType(entry->map_value(), unused) + ">";
+        dflt = "";
+      } else if (field->has_optional_keyword()) {
         cpptype = "std::optional<" + cpptype + ">";
         dflt = "";
       } else if (field->is_required()) {
@@ -134,6 +145,7 @@ struct FileGenerator {
 
     // generate the nested types
     for (int i=0; i<msg->nested_type_count(); i++) {
+      if (msg->nested_type(i)->options().map_entry())  continue;
       generateStruct(msg->nested_type(i));
     }
 
@@ -141,6 +153,31 @@ struct FileGenerator {
     printer->Print("};\n");
   }
 
+  string cppType(FieldDescriptor const* field, string& dflt) {
+    string cpptype;
+    switch (field->type()) {
+      case FieldDescriptor::TYPE_DOUBLE:   cpptype = "double"; break;
+      case FieldDescriptor::TYPE_FLOAT:    cpptype = "float"; break;
+      case FieldDescriptor::TYPE_INT64:    cpptype = "int64_t"; break;
+      case FieldDescriptor::TYPE_UINT64:   cpptype = "uint64_t"; break;
+      case FieldDescriptor::TYPE_INT32:    cpptype = "int32_t"; break;
+      case FieldDescriptor::TYPE_FIXED64:  cpptype = "int64_t"; break;
+      case FieldDescriptor::TYPE_FIXED32:  cpptype = "int32_t"; break;
+      case FieldDescriptor::TYPE_BOOL:     cpptype = "bool"; dflt = " = false"; break;
+      case FieldDescriptor::TYPE_STRING:   cpptype = "std::string"; dflt = ""; break;
+      case FieldDescriptor::TYPE_GROUP:    error_will_not_support("TYPE_GROUP"); break;
+      case FieldDescriptor::TYPE_MESSAGE:  cpptype = field->message_type()->name(); dflt = ""; break;
+      case FieldDescriptor::TYPE_BYTES:    cpptype = "::pbcpp::bytes"; dflt = ""; break;
+      case FieldDescriptor::TYPE_UINT32:   cpptype = "uint32_t"; break;
+      case FieldDescriptor::TYPE_ENUM:     cpptype = field->type_name(); break;
+      case FieldDescriptor::TYPE_SFIXED32: cpptype = "int32_t"; break;
+      case FieldDescriptor::TYPE_SFIXED64: cpptype = "int64_t"; break;
+      case FieldDescriptor::TYPE_SINT32:   cpptype = "int32_t"; break;
+      case FieldDescriptor::TYPE_SINT64:   cpptype = "int64_t"; break;
+    }
+    return cpptype;
+  }
+
 
   void generateReflection(Descriptor const* msg, cstr& baseName) {
     string msgname = baseName + "::" + msg->name();
@@ -148,47 +185,71 @@ struct FileGenerator {
 
     printer->Print("template <> struct reflect<$name$> : fields<\n", "name", msgname);
     printer->Indent();
+    std::vector<string> specs;
     for (int i=0; i<msg->field_count(); i++) {
       auto field = msg->field(i);
 
-      // resolve the type
-      string type;
-      switch (field->type()) {
-        case FieldDescriptor::TYPE_DOUBLE:   type = "TYPE_DOUBLE"; break;
-        case FieldDescriptor::TYPE_FLOAT:    type = "TYPE_FLOAT"; break;
-        case FieldDescriptor::TYPE_INT64:    type = "TYPE_INT64"; break;
-        case FieldDescriptor::TYPE_UINT64:   type = "TYPE_UINT64"; break;
-        case FieldDescriptor::TYPE_INT32:    type = "TYPE_INT32"; break;
-        case FieldDescriptor::TYPE_FIXED64:  type = "TYPE_FIXED64"; break;
-        case FieldDescriptor::TYPE_FIXED32:  type = "TYPE_FIXED32"; break;
-        case FieldDescriptor::TYPE_BOOL:     type = "TYPE_BOOL"; break;
-        case FieldDescriptor::TYPE_STRING:   type = "TYPE_STRING"; break;
-        case FieldDescriptor::TYPE_GROUP:    type = "TYPE_GROUP"; break;
-        case FieldDescriptor::TYPE_MESSAGE:  type = "TYPE_MESSAGE"; break;
-        case FieldDescriptor::TYPE_BYTES:    type = "TYPE_BYTES"; break;
-        case FieldDescriptor::TYPE_UINT32:   type = "TYPE_UINT32"; break;
-        case FieldDescriptor::TYPE_ENUM:     type = "TYPE_ENUM"; break;
-        case FieldDescriptor::TYPE_SFIXED32: type = "TYPE_SFIXED32"; break;
-        case FieldDescriptor::TYPE_SFIXED64: type = "TYPE_SFIXED64"; break;
-        case FieldDescriptor::TYPE_SINT32:   type = "TYPE_SINT32"; break;
-        case FieldDescriptor::TYPE_SINT64:   type = "TYPE_SINT64"; break;
+      // resolve the field spec
+      if (auto oneof = field->real_containing_oneof()) {
+        if (oneof->field(0) != field)  continue;
+        string spec = "oneof_field<\"" + oneof->name() + "\", &" + msgname + "::" + oneof->name();
+        for (int j=0; j<oneof->field_count(); j++) {
+          auto alt = oneof->field(j);
+          spec += ",\n  field<" + pbType(alt) + ", \"" + alt->name() + "\", " +
+                  std::to_string(alt->number()) + ", nullptr>";
+        }
+        specs.push_back(spec + ">");
+      } else if (field->is_map()) {
+        auto entry = field->message_type();
+        specs.push_back("map_field<" + pbType(entry->map_key()) + ", " + pbType(entry->map_value()) +
+          ", \"" + field->name() + "\", " + std::to_string(field->number()) + ", &" + msgname + "::" +
+          field->name() + ">");
+      } else {
+        specs.push_back("field<" + pbType(field) + ", \"" + field->name() + "\", " +
+          std::to_string(field->number()) + ", &" + msgname + "::" + field->name() + ">");
       }
+    }
 
-      // write the field
-      if ((i+1) == msg->field_count())  comma = "";
-      printer->Print("field<$type$, \"$name$\", $num$, &$msgname$::$name$>$comma$\n",
-        "name", field->name(), "num", std::to_string(field->number()), "msgname", msgname,
-        "type", type, "comma", comma);
+    // write the fields
+    for (size_t i=0; i<specs.size(); i++) {
+      if ((i+1) == specs.size())  comma = "";
+      printer->Print("$spec$$comma$\n", "spec", specs[i], "comma", comma);
     }
     printer->Outdent();
-    printer->Print("> {};\n\n");
+    printer->Print("> {\n  static constexpr string_view full_name = \"$fullname$\";\n};\n\n",
+      "fullname", msg->full_name());
 
     // generate the nested types
     for (int i=0; i<msg->nested_type_count(); i++) {
+      if (msg->nested_type(i)->options().map_entry())  continue;
       generateReflection(msg->nested_type(i), msgname);
     }
   }
 
+  string pbType(FieldDescriptor const* field) {
+    switch (field->type()) {
+      case FieldDescriptor::TYPE_DOUBLE:   return "TYPE_DOUBLE";
+      case FieldDescriptor::TYPE_FLOAT:    return "TYPE_FLOAT";
+      case FieldDescriptor::TYPE_INT64:    return "TYPE_INT64";
+      case FieldDescriptor::TYPE_UINT64:   return "TYPE_UINT64";
+      case FieldDescriptor::TYPE_INT32:    return "TYPE_INT32";
+      case FieldDescriptor::TYPE_FIXED64:  return "TYPE_FIXED64";
+      case FieldDescriptor::TYPE_FIXED32:  return "TYPE_FIXED32";
+      case FieldDescriptor::TYPE_BOOL:     return "TYPE_BOOL";
+      case FieldDescriptor::TYPE_STRING:   return "TYPE_STRING";
+      case FieldDescriptor::TYPE_GROUP:    return "TYPE_GROUP";
+      case FieldDescriptor::TYPE_MESSAGE:  return "TYPE_MSG";
+      case FieldDescriptor::TYPE_BYTES:    return "TYPE_BYTES";
+      case FieldDescriptor::TYPE_UINT32:   return "TYPE_UINT32";
+      case FieldDescriptor::TYPE_ENUM:     return "TYPE_ENUM";
+      case FieldDescriptor::TYPE_SFIXED32: return "TYPE_SFIXED32";
+      case FieldDescriptor::TYPE_SFIXED64: return "TYPE_SFIXED64";
+      case FieldDescriptor::TYPE_SINT32:   return "TYPE_SINT32";
+      case FieldDescriptor::TYPE_SINT64:   return "TYPE_SINT64";
+    }
+    return "";
+  }
+
 
   // ---- errors
   void error_will_not_support(string_view sv) {
@@ -2,6 +2,7 @@
 #include <catch2/catch_all.hpp>
 #include "simple.pb.h"
 #include "simple.hpp"
+#include <thread>
 using std::string;
 using namespace test::pbcpp;
 
@@ -88,3 +89,479 @@ TEST_CASE("simple message") {
   }
 }
 
+
+TEST_CASE("zigzag fields") {
+  int64_t const values[] = {0, -1, 1, (int64_t(1) << 62) + 5, -(int64_t(1) << 62) - 5,
+                            INT64_MAX, INT64_MIN};
+
+  test::orig::Signed orig;
+  orig.set_small(INT32_MIN);
+  orig.set_big((int64_t(1) << 62) + 5);
+  for (auto v : values)  orig.add_values(v);
+  auto data = orig_serialize(orig);
+
+  Signed msg;
+  pbcpp::decoder::from_string(data, msg);
+  REQUIRE( msg.small == INT32_MIN );
+  REQUIRE( msg.big == (int64_t(1) << 62) + 5 );
+  REQUIRE( msg.values == std::vector<int64_t>(std::begin(values), std::end(values)) );
+  REQUIRE( pbcpp::encoder::to_string(msg) == data );
+
+  static_assert(pbcpp::impl::unzigzag64(pbcpp::impl::zigzag64(INT64_MIN)) == INT64_MIN);
+  static_assert(pbcpp::impl::unzigzag32(pbcpp::impl::zigzag32(INT32_MAX)) == INT32_MAX);
+}
+
+
+
+TEST_CASE("cached sub-messages") {
+  Outer msg;
+  msg.id = 7;
+  msg.big = Inner{"big", 1234};
+  msg.items.push_back(Inner{"a", 1});
+  msg.items.push_back(Inner{"b", 2});
+
+  SECTION("encoding") {
+    REQUIRE( !msg.big.is_cached() );
+    auto data = pbcpp::encoder::to_string(msg);
+    REQUIRE( msg.big.is_cached() );
+    REQUIRE( msg.items[1].is_cached() );
+    REQUIRE( pbcpp::encoder::to_string(msg) == data );
+
+    // verify against the original implementation
+    test::orig::Outer orig;
+    REQUIRE( orig.ParseFromString(data) );
+    REQUIRE( orig.id() == 7 );
+    REQUIRE( orig.big().name() == "big" );
+    REQUIRE( orig.big().num() == 1234 );
+    REQUIRE( orig.items_size() == 2 );
+    REQUIRE( orig.items(1).name() == "b" );
+
+    // decode back again
+    Outer msg2;
+    pbcpp::decoder::from_string(data, msg2);
+    REQUIRE( msg2 == msg );
+  }
+
+  SECTION("invalidation") {
+    pbcpp::encoder::to_string(msg);
+    auto gen = msg.big.generation();
+    msg.big.mut().num = 99;
+    REQUIRE( msg.big.generation() != gen );
+    REQUIRE( !msg.big.is_cached() );
+    REQUIRE( msg.items[0].is_cached() );
+
+    test::orig::Outer orig;
+    REQUIRE( orig.ParseFromString(pbcpp::encoder::to_string(msg)) );
+    REQUIRE( orig.big().num() == 99 );
+    REQUIRE( orig.items(0).name() == "a" );
+  }
+
+  SECTION("concurrent encoding") {
+    Outer const& shared = msg;
+    auto expected = pbcpp::encoder::to_string(Outer(msg));
+    std::vector<std::thread> threads;
+    std::vector<std::string> results(4);
+    for (size_t i=0; i<results.size(); i++) {
+      threads.emplace_back([&, i] {
+        for (int n=0; n<100; n++)  results[i] = pbcpp::encoder::to_string(shared);
+      });
+    }
+    for (auto& t : threads)  t.join();
+    for (auto& r : results)  REQUIRE( r == expected );
+    REQUIRE( shared.big.is_cached() );
+  }
+
+  SECTION("copying while encoding") {
+    Outer const& shared = msg;
+    std::thread encoding([&] {
+      for (int n=0; n<100; n++)  pbcpp::encoder::to_string(shared);
+    });
+    for (int n=0; n<100; n++) {
+      Outer copy = shared;
+      REQUIRE( copy == shared );
+    }
+    encoding.join();
+    Outer copy = shared;
+    REQUIRE( copy.big.is_cached() );
+    REQUIRE( copy.big.encoded() == shared.big.encoded() );
+  }
+
+  SECTION("moving") {
+    pbcpp::encoder::to_string(msg);
+    auto enc = msg.items[0].encoded();
+    for (int i=0; i<100; i++)  msg.items.push_back(Inner{"x", i});
+    REQUIRE( msg.items[0].is_cached() );
+    REQUIRE( msg.items[0].encoded() == enc );
+
+    // the encoded bytes move along with the value
+    pbcpp::encoder::to_string(msg);
+    auto big_enc = msg.big.encoded();
+    auto moved = std::move(msg.big);
+    REQUIRE( moved.is_cached() );
+    REQUIRE( moved.encoded() == big_enc );
+    REQUIRE( !msg.big.is_cached() );
+  }
+}
+
+
+TEST_CASE("indexed view") {
+  test::orig::Stats orig;
+  orig.set_key("requests");
+  orig.set_count(41);
+  orig.set_score(2.5);
+  orig.add_ids(3);
+  orig.add_ids(9);
+  orig.mutable_owner()->set_name("bob");
+  auto data = orig_serialize(orig);
+
+  SECTION("point reads") {
+    pbcpp::indexed_view<Stats> view(std::string_view{data});
+    REQUIRE( view.has<1>() );
+    REQUIRE( view.get<1>() == "requests" );
+    REQUIRE( view.get<2>() == 41 );
+    REQUIRE( view.get<3>() == 2.5 );
+    REQUIRE( view.get<4>() == std::vector<int32_t>{3,9} );
+    REQUIRE( view.get<5>().name == "bob" );
+    REQUIRE( view.decode().key == "requests" );
+
+    pbcpp::indexed_view<Stats> empty(std::string_view{});
+    REQUIRE( !empty.has<2>() );
+    REQUIRE( empty.get<2>() == 0 );
+  }
+
+  SECTION("patching") {
+    pbcpp::indexed_view<Stats> view(data);
+    view.patch<2>(42);
+    view.patch<3>(-1.25);
+    REQUIRE( view.get<2>() == 42 );
+
+    test::orig::Stats orig2;
+    REQUIRE( orig2.ParseFromString(data) );
+    REQUIRE( orig2.count() == 42 );
+    REQUIRE( orig2.score() == -1.25 );
+    REQUIRE( orig2.key() == "requests" );
+
+    pbcpp::indexed_view<Stats> readonly(std::string_view{data});
+    REQUIRE_THROWS( readonly.patch<2>(1) );
+  }
+
+  SECTION("malformed lengths") {
+    // an unknown field whose length wraps negative as an i32, and one that runs past the end
+    std::string_view const bad[] = {
+      std::string_view("\x62\xfa\xff\xff\xff\x0f", 6),
+      std::string_view("\x0a\x05" "abc", 5),
+      std::string_view("\x11\x01\x02", 3),
+    };
+    for (auto sv : bad) {
+      REQUIRE_THROWS( pbcpp::indexed_view<Stats>(sv) );
+      Stats msg;
+      REQUIRE_THROWS( pbcpp::decoder::from_string(sv, msg) );
+    }
+  }
+}
+
+
+TEST_CASE("map fields") {
+
+  SECTION("flat_map") {
+    pbcpp::flat_map<int32_t, std::string> map;
+    for (int i=0; i<1000; i++) {
+      map[i*16] = std::to_string(i);
+    }
+    REQUIRE( map.size() == 1000 );
+    REQUIRE( map.at(160) == "10" );
+    REQUIRE( !map.contains(17) );
+
+    for (int i=0; i<1000; i+=2) {
+      REQUIRE( map.erase(i*16) == 1 );
+    }
+    REQUIRE( map.erase(0) == 0 );
+    REQUIRE( map.size() == 500 );
+    for (int i=0; i<1000; i++) {
+      REQUIRE( map.contains(i*16) == (i%2 == 1) );
+    }
+
+    size_t n = 0;
+    for (auto& [k, v] : map) {
+      REQUIRE( v == std::to_string(k/16) );
+      n++;
+    }
+    REQUIRE( n == 500 );
+
+    // keys can't be modified in place, as with std::unordered_map
+    static_assert(std::is_const_v<decltype(map.begin()->first)>);
+    auto copy = map;
+    copy[1] = "one";
+    map = copy;
+    REQUIRE( map.size() == 501 );
+    REQUIRE( map.at(1) == "one" );
+  }
+
+  SECTION("flat_map moves entries") {
+    // growing and erasing move keys and values instead of copying them
+    static int copies = 0;
+    struct key {
+      int k;
+      key(int k_) : k(k_) {}
+      key(key const& o) : k(o.k) { copies++; }
+      key(key&&) = default;
+      bool operator==(key const& o) const { return k == o.k; }
+    };
+    struct key_hash {
+      size_t operator()(key const& v) const { return v.k; }
+    };
+
+    pbcpp::flat_map<key, std::unique_ptr<int>, key_hash> map;
+    for (int i=0; i<1000; i++) {
+      map.insert_or_assign(key(i), std::make_unique<int>(i));
+    }
+    for (int i=0; i<1000; i+=3) {
+      REQUIRE( map.erase(key(i)) == 1 );
+    }
+    REQUIRE( copies == 0 );
+    REQUIRE( *map.at(key(500)) == 500 );
+    REQUIRE( !map.contains(key(501)) );
+  }
+
+  SECTION("encoding") {
+    test::orig::Config orig;
+    orig.set_name("cfg");
+    (*orig.mutable_counts())["a"] = 1;
+    (*orig.mutable_counts())["b"] = 0;
+    (*orig.mutable_counts())["c"] = 300;
+    (*orig.mutable_inners())[7].set_name("seven");
+    auto data = orig_serialize(orig);
+
+    Config msg;
+    pbcpp::decoder::from_string(data, msg);
+    REQUIRE( msg.counts.size() == 3 );
+    REQUIRE( msg.counts.at("b") == 0 );
+    REQUIRE( msg.counts.at("c") == 300 );
+    REQUIRE( msg.inners.at(7).name == "seven" );
+
+    // encode back again
+    test::orig::Config orig2;
+    REQUIRE( orig2.ParseFromString(pbcpp::encoder::to_string(msg)) );
+    REQUIRE( orig2.counts().size() == 3 );
+    REQUIRE( orig2.counts().at("c") == 300 );
+    REQUIRE( orig2.inners().at(7).name() == "seven" );
+
+    Config msg2;
+    pbcpp::decoder::from_string(pbcpp::encoder::to_string(msg), msg2);
+    REQUIRE( msg2 == msg );
+    REQUIRE( std::hash<Config>{}(msg2) == std::hash<Config>{}(msg) );
+  }
+}
+
+
+TEST_CASE("oneof fields") {
+
+  SECTION("decoding") {
+    test::orig::Event orig;
+    orig.set_ts(5);
+    orig.set_code(0);
+    Event msg;
+    pbcpp::decoder::from_string(orig_serialize(orig), msg);
+    REQUIRE( msg.ts == 5 );
+    REQUIRE( msg.payload.index() == 2 );
+    REQUIRE( std::get<2>(msg.payload) == 0 );
+
+    orig.set_retry_code(12);
+    pbcpp::decoder::from_string(orig_serialize(orig), msg);
+    REQUIRE( msg.payload.index() == 4 );
+    REQUIRE( std::get<4>(msg.payload) == 12 );
+
+    orig.mutable_inner()->set_name("bob");
+    pbcpp::decoder::from_string(orig_serialize(orig), msg);
+    REQUIRE( std::get<3>(msg.payload).name == "bob" );
+  }
+
+  SECTION("encoding") {
+    Event msg;
+    msg.payload.emplace<1>("hello");
+
+    test::orig::Event orig;
+    REQUIRE( orig.ParseFromString(pbcpp::encoder::to_string(msg)) );
+    REQUIRE( orig.payload_case() == test::orig::Event::kText );
+    REQUIRE( orig.text() == "hello" );
+
+    msg.payload.emplace<3>();
+    REQUIRE( orig.ParseFromString(pbcpp::encoder::to_string(msg)) );
+    REQUIRE( orig.payload_case() == test::orig::Event::kInner );
+
+    msg.payload = std::monostate{};
+    REQUIRE( pbcpp::encoder::to_string(msg).empty() );
+  }
+
+  SECTION("to_string") {
+    Event msg;
+    msg.ts = 3;
+    REQUIRE( std::to_string(msg) == "{ts:3,payload:{}}" );
+    msg.payload.emplace<4>(7);
+    REQUIRE( std::to_string(msg) == "{ts:3,payload:{retry_code:7}}" );
+  }
+
+  SECTION("compare") {
+    Event m1, m2;
+    m1.payload.emplace<2>(7);
+    m2.payload.emplace<4>(7);
+    REQUIRE( m1 < m2 );
+    m2.payload.emplace<2>(7);
+    REQUIRE( m1 == m2 );
+    REQUIRE( std::hash<Event>{}(m1) == std::hash<Event>{}(m2) );
+  }
+}
+
+
+TEST_CASE("bytes fields") {
+  test::orig::Blob orig;
+  orig.set_name("blob");
+  orig.set_data(std::string(100000, 'x'));
+  orig.add_parts("small");
+  orig.add_parts(std::string(5000, 'y'));
+  auto buf = std::make_shared<std::string const>(orig_serialize(orig));
+
+  SECTION("shared decoding") {
+    Blob msg;
+    pbcpp::decoder::from_shared(buf, msg);
+    REQUIRE( msg.data.size() == 100000 );
+    REQUIRE( msg.data.view() == orig.data() );
+    REQUIRE( msg.parts[0] == "small" );
+
+    // large values reference the input, small ones are copied
+    auto in_buf = [&](pbcpp::bytes const& b) {
+      return (b.data() >= buf->data()) && (b.end() <= buf->data() + buf->size());
+    };
+    REQUIRE( in_buf(msg.data) );
+    REQUIRE( in_buf(msg.parts[1]) );
+    REQUIRE( !in_buf(msg.parts[0]) );
+
+    Blob msg2;
+    pbcpp::decoder::from_string(*buf, msg2);
+    REQUIRE( !in_buf(msg2.data) );
+    REQUIRE( msg2 == msg );
+  }
+
+  SECTION("chunked encoding") {
+    Blob msg;
+    pbcpp::decoder::from_shared(buf, msg);
+
+    pbcpp::encoder encoder;
+    encoder.encode_top(msg);
+    std::vector<std::string_view> chunks;
+    encoder.each_chunk([&](std::string_view chunk) { chunks.push_back(chunk); });
+    REQUIRE( chunks.size() == 4 );
+    REQUIRE( chunks[1].data() == msg.data.data() );
+    REQUIRE( chunks[3].data() == msg.parts[1].data() );
+
+    test::orig::Blob orig2;
+    REQUIRE( orig2.ParseFromString(encoder.as_str()) );
+    REQUIRE( orig2.data() == orig.data() );
+    REQUIRE( orig2.parts(1) == orig.parts(1) );
+    REQUIRE( orig2.name() == "blob" );
+  }
+
+  SECTION("many shared parts") {
+    test::orig::Blob many;
+    for (int i=0; i<1000; i++) {
+      many.add_parts(std::string(pbcpp::bytes::SHARE_MIN, 'a' + (i % 26)));
+    }
+    auto many_buf = std::make_shared<std::string const>(orig_serialize(many));
+    Blob msg;
+    pbcpp::decoder::from_shared(many_buf, msg);
+
+    // the tags and lengths between the parts all fit in the first buffer
+    pbcpp::encoder encoder;
+    encoder.encode_top(msg);
+    size_t nchunks = 0;
+    encoder.each_chunk([&](std::string_view) { nchunks++; });
+    REQUIRE( nchunks == 2000 );
+    REQUIRE( std::count_if(encoder.bufs.begin(), encoder.bufs.end(), [](auto& b) { return b.owned; }) == 1 );
+    REQUIRE( encoder.as_str() == *many_buf );
+  }
+
+  SECTION("inside a cached sub-message") {
+    Envelope env;
+    env.id = 1;
+    pbcpp::decoder::from_shared(buf, env.blob.mut());
+    auto data = env.blob->data.data();
+
+    // both the encode that fills the cache and the ones that splice it in reference the data
+    for (int pass=0; pass<2; pass++) {
+      pbcpp::encoder encoder;
+      encoder.encode_top(env);
+      REQUIRE( env.blob.is_cached() );
+      bool shared = false;
+      encoder.each_chunk([&](std::string_view chunk) { shared |= (chunk.data() == data); });
+      REQUIRE( shared );
+
+      test::orig::Envelope orig2;
+      REQUIRE( orig2.ParseFromString(encoder.as_str()) );
+      REQUIRE( orig2.blob().data() == orig.data() );
+      REQUIRE( orig2.blob().parts(1) == orig.parts(1) );
+    }
+  }
+}
+
+
+TEST_CASE("metrics disabled") {
+  // this file is built with the default configuration; see test_metrics.cpp for the counters
+  static_assert(!pbcpp::metrics::enabled);
+  static_assert(std::is_empty_v<pbcpp::metrics::encoder_allocs>);
+
+  SimpleMessage msg;
+  msg.name = "bob";
+  pbcpp::decoder::from_string(pbcpp::encoder::to_string(msg), msg);
+  REQUIRE( pbcpp::metrics::snapshot().empty() );
+}
+
+
+TEST_CASE("constant encoding") {
+  static constexpr auto make_simple = [] {
+    SimpleMessage msg;
+    msg.name = "heartbeat";
+    msg.num = -5;
+    msg.nums = {1, 300, -2};
+    return msg;
+  };
+  static constexpr auto encoded = pbcpp::encode_constant<make_simple>();
+  static_assert( encoded.size() == pbcpp::byte_size(make_simple()) );
+  std::string_view sv(encoded.data(), encoded.size());
+
+  SECTION("matches the runtime encoder") {
+    REQUIRE( sv == pbcpp::encoder::to_string(make_simple()) );
+
+    test::orig::SimpleMessage orig;
+    REQUIRE( orig.ParseFromString(std::string(sv)) );
+    REQUIRE( orig.name() == "heartbeat" );
+    REQUIRE( orig.num() == -5 );
+    REQUIRE( get_repeated(orig.mutable_nums()) == std::vector<int64_t>{1, 300, -2} );
+    REQUIRE( orig_serialize(orig) == sv );
+  }
+
+  SECTION("nested messages and oneofs") {
+    static constexpr auto event = pbcpp::encode_constant<[] {
+      Event msg;
+      msg.ts = 1700000000;
+      msg.payload.emplace<3>(Inner{"canned", 42});
+      return msg;
+    }>();
+    std::string_view esv(event.data(), event.size());
+
+    test::orig::Event orig;
+    REQUIRE( orig.ParseFromString(std::string(esv)) );
+    REQUIRE( orig.ts() == 1700000000 );
+    REQUIRE( orig.inner().name() == "canned" );
+    REQUIRE( orig.inner().num() == 42 );
+  }
+
+  SECTION("tags") {
+    static_assert( pbcpp::tag_bytes<1, pbcpp::WT_LEN> == std::array<char,1>{0x0a} );
+    static_assert( pbcpp::tag_bytes<16, pbcpp::WT_VARINT>.size() == 2 );
+
+    pbcpp::encoder encoder;
+    encoder.write(encoded);
+    encoder.encode_tag<3, pbcpp::WT_VARINT>();
+    REQUIRE( encoder.as_str() == "\x18" + std::string(sv) );
+  }
+}
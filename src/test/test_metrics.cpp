@@ -0,0 +1,49 @@
+#include <protobuf-cpp/protobuf-cpp.hpp>
+#include <catch2/catch_all.hpp>
+#include "simple.pb.h"
+#include "simple.hpp"
+#include <thread>
+using namespace test::pbcpp;
+
+// built with PBCPP_METRICS=1 and PBCPP_METRICS_FIELDS=1, unlike test.cpp
+
+
+TEST_CASE("metrics") {
+  auto find = [](std::string_view name) {
+    for (auto& st : pbcpp::metrics::snapshot()) {
+      if (st.name == name)  return st;
+    }
+    return pbcpp::metrics::type_stats{};
+  };
+
+  SimpleMessage msg;
+  msg.name = "bob";
+  msg.nums = {1,2,3};
+  auto data = pbcpp::encoder::to_string(msg);
+  auto before = find("test.orig.SimpleMessage");
+  auto inner_before = find("test.orig.Inner");
+
+  // encode on this thread and on another one that exits before the snapshot
+  pbcpp::encoder::to_string(msg);
+  std::thread([&] {
+    pbcpp::encoder::to_string(msg);
+    pbcpp::decoder::from_string(data, msg);
+  }).join();
+  Inner inner;
+  pbcpp::decoder::from_string(data, inner);
+
+  auto after = find("test.orig.SimpleMessage");
+  REQUIRE( after.encode.count - before.encode.count == 2 );
+  REQUIRE( after.encode.bytes - before.encode.bytes == 2*data.size() );
+  REQUIRE( after.encode.hist[std::bit_width(data.size())] - before.encode.hist[std::bit_width(data.size())] == 2 );
+  REQUIRE( after.decode.count - before.decode.count == 1 );
+  REQUIRE( after.chunk_allocs - before.chunk_allocs == 2 );
+  REQUIRE( after.fields.size() == 3 );
+  REQUIRE( after.fields[0].name == "name" );
+  REQUIRE( after.fields[0].encode_bytes - before.fields[0].encode_bytes == 2*5 );
+  REQUIRE( after.fields[0].decode_bytes - before.fields[0].decode_bytes == 5 );
+
+  auto inner_after = find("test.orig.Inner");
+  REQUIRE( inner_after.decode.count - inner_before.decode.count == 1 );
+  REQUIRE( inner_after.unknown_skips - inner_before.unknown_skips == 1 );
+}